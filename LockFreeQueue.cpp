@@ -34,6 +34,54 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/// \brief One memory-mapped spill file.
+///
+/// Records are appended by the storing thread and read by the fetching thread. The
+/// storing thread deletes the segment once the fetching thread has moved on to the next
+/// one or has read every record, so Fetch never touches the file system.
+struct SpillSegment {
+    SpillSegment * volatile mNext;  //!< next segment, set before the first record in it is counted
+    unsigned char *mData;           //!< mapped file content
+    unsigned long mLength;          //!< length of the mapping
+    unsigned long mWritePosition;   //!< storing thread only
+    unsigned long mReadPosition;    //!< fetching thread only
+    int mFileDescriptor;
+    char mPath[1024];
+};
+
+/// \brief Header in front of every spilled blob.
+struct SpillRecordHeader {
+    unsigned long mLength;          //!< length of the blob following the header or kSpillEndOfSegment
+    unsigned long mRingStoreCount;  //!< count of blobs stored into the ring before this one was spilled, i.e. the sequence of the next ring blob
+};
+
+const static unsigned long kSpillEndOfSegment = ~0ul; //!< record length that marks the end of a segment
+
+const static long kBroadcastCursorFree = 0;     //!< slot can be claimed by Subscribe
+const static long kBroadcastCursorClaimed = 1;  //!< Subscribe is setting up the slot
+const static long kBroadcastCursorActive = 2;   //!< subscriber holds back the ranges it hasn't fetched
+const static long kBroadcastCursorDetached = 3; //!< subscriber lagged behind and was dropped by the storing thread
+const static long kBroadcastCursorStateMask = 3; //!< BroadcastCursor::mState bits holding the state, the generation is above
+const static long kBroadcastCursorGeneration = 4; //!< one generation step, added by every Subscribe
+
+static long BroadcastCursorState(long inStateAndGeneration)
+{
+    return inStateAndGeneration & kBroadcastCursorStateMask;
+}
+
+static long BroadcastCursorWithState(long inStateAndGeneration, long inState)
+{
+    return (inStateAndGeneration & ~kBroadcastCursorStateMask) | inState;
+}
+
+static unsigned long SpillAlignedLength(unsigned long inLength)
+{
+    const unsigned long alignment = sizeof(unsigned long);
+    return (inLength + alignment - 1) & ~(alignment - 1);
+}
 
 LockFreeQueue::LockFreeQueue()
 {
@@ -42,6 +90,15 @@ LockFreeQueue::LockFreeQueue()
 
 LockFreeQueue::~LockFreeQueue()
 {
+    SpillSegment *segment = mSpillOldestSegment;
+    while (segment)
+    {
+        SpillSegment *next = segment->mNext;
+        DeleteSpillSegment(segment);
+        segment = next;
+    }
+    free(mSpillDirectory);
+    
     free(mDataRing);
 }
 
@@ -67,6 +124,70 @@ void LockFreeQueue::InitWithMaxBytesDoOverwrite(unsigned long maxBytes, bool doO
 
     memset(&mInternalRangeList, 0, sizeof(RangeList));
     mRangeList = &mInternalRangeList;
+    mRangeListVersion = 0;
+    
+    mRingStoreCount = 0;
+    
+    mSpillDirectory = NULL;
+    mSpillSegmentBytes = 0;
+    mSpillOldestSegment = NULL;
+    mSpillWriteSegment = NULL;
+    mSpillReadSegment = NULL;
+    mSpillStoreCount = 0;
+    mSpillFetchCount = 0;
+    
+    mIsBroadcast = false;
+    mDoDetachLaggards = false;
+    memset(mCursors, 0, sizeof(mCursors));
+    
+    mTraceFunction = NULL;
+    mTraceContext = NULL;
+}
+
+/**
+ \brief Enable spilling to memory-mapped files.
+ \param inDirectory directory the segment files are created in
+ \param inSegmentBytes length of one segment file. A segment is made larger if a single blob doesn't fit.
+ 
+ Call this after InitWithMaxBytesDoOverwrite and before the queue is used. Segment files the
+ fetching thread has read are deleted by the next Spill or by DeleteFetchedSpillSegments, so a
+ new spill after the spilled blobs were all fetched starts a new segment file.
+ */
+void LockFreeQueue::InitSpillWithDirectorySegmentBytes(const char *inDirectory, unsigned long inSegmentBytes)
+{
+    mSpillDirectory = strdup(inDirectory);
+    mSpillSegmentBytes = inSegmentBytes;
+}
+
+
+
+/**
+ \brief Switch to broadcast mode.
+ \param doDetachLaggards if true, ReserveRange detaches the slowest subscribers until the blob fits. If false, it returns LockFreeQueue_notEnoughSpaceLeft.
+ 
+ In broadcast mode every blob is stored once and fetched by every subscriber with
+ FetchBroadcast. Its bytes are given back when the slowest subscriber has fetched it.
+ Lanes are ignored, Fetch and Spill can't be used. Call this after InitWithMaxBytesDoOverwrite
+ and before the queue is used.
+ */
+void LockFreeQueue::InitBroadcastDoDetachLaggards(bool doDetachLaggards)
+{
+    mIsBroadcast = true;
+    mDoDetachLaggards = doDetachLaggards;
+}
+
+/**
+ \brief Record ReserveRange, Store and Fetch calls.
+ \param inFunction called after every call with its byte count, lane and result, NULL to stop tracing. Use LockFreeQueueTracer::TraceFunction to write a trace file.
+ \param inContext passed to inFunction. It must outlive the queue or be removed first.
+ 
+ Set this before the queue is used. inFunction is called on the storing and the fetching
+ thread, so it must not block.
+ */
+void LockFreeQueue::SetTraceFunction(LockFreeQueueTraceFunction inFunction, void *inContext)
+{
+    mTraceContext = inContext;
+    mTraceFunction = inFunction;
 }
 
 
@@ -81,6 +202,19 @@ void LockFreeQueue::InitWithMaxBytesDoOverwrite(unsigned long maxBytes, bool doO
  This method should only be called from the storing thread
  */
 LockFreeQueueReturnCode     LockFreeQueue::Store(const char *inBufferToStore, unsigned long inBufferLength, RangeList* inReservedList, RangeList* inOutRangeList)
+{
+    unsigned long lane = inReservedList->mReservedLane;
+    LockFreeQueueReturnCode result = DoStore(inBufferToStore, inBufferLength, inReservedList, inOutRangeList);
+    
+    if (mTraceFunction)
+    {
+        mTraceFunction(mTraceContext, LockFreeQueueTrace_store, inBufferLength, lane, result);
+    }
+    
+    return result;
+}
+
+LockFreeQueueReturnCode     LockFreeQueue::DoStore(const char *inBufferToStore, unsigned long inBufferLength, RangeList* inReservedList, RangeList* inOutRangeList)
 {
     if (inReservedList == inOutRangeList)
     {
@@ -131,13 +265,26 @@ LockFreeQueueReturnCode     LockFreeQueue::Store(const char *inBufferToStore, un
         memcpy(&(mDataRing[secondByteRange.mPosition]), &(inBufferToStore[firstByteRange.mLength]), inBufferLength-firstByteRange.mLength);
     }
 
+    unsigned long lane = oldRangeList->mReservedLane;
+    
     inOutRangeList->mFullRanges[inOutRangeList->mFullRangeCount] = oldRangeList->mReservedRange;
+    inOutRangeList->mFullRangeLanes[inOutRangeList->mFullRangeCount] = (unsigned char)lane;
+    inOutRangeList->mFullRangeFetched[inOutRangeList->mFullRangeCount] = false;
     inOutRangeList->mFullRangeCount++;
+    inOutRangeList->mFullByteCount += oldRangeList->mReservedRange.mLength;
+    inOutRangeList->mPendingLaneCounts[lane]++;
+    inOutRangeList->mPendingLaneMask |= (1ul << lane);
     inOutRangeList->mReservedRange.mLength = 0;
     inOutRangeList->mReservedRange.mPosition = 0;
+    inOutRangeList->mReservedLane = 0;
     inOutRangeList->mHasReserved = false;
     
-    bool result = OSAtomicCompareAndSwapPtr(oldRangeList, inOutRangeList, (void* volatile*)&mRangeList);
+    bool result = SwapRangeList(oldRangeList, inOutRangeList);
+    
+    if (result)
+    {
+        mRingStoreCount++;
+    }
     
     return result ? LockFreeQueue_OK : LockFreeQueue_casUnsuccessful;
 }
@@ -149,11 +296,44 @@ LockFreeQueueReturnCode     LockFreeQueue::Store(const char *inBufferToStore, un
  \param inBufferLength length of supplied buffer in inOutBuffer
  \param inOutRangeList RangeList to hold new state
  \param outReturnedBytesCount count of bytes which are returned
+ \param outLane lane of the returned blob, spilled blobs are lane 0. Can be NULL.
+ 
+ Returns the oldest blob of the highest lane that holds data. Spilled blobs belong to lane 0,
+ they are returned once no higher lane holds data and all blobs stored into the ring before
+ them are fetched.
  
  This method should only be called from the fetching thread
  */
-LockFreeQueueReturnCode LockFreeQueue::Fetch(char *inOutBuffer, unsigned long inBufferLength, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount)
+LockFreeQueueReturnCode LockFreeQueue::Fetch(char *inOutBuffer, unsigned long inBufferLength, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount, unsigned long * outLane)
 {
+    unsigned long lane = 0;
+    LockFreeQueueReturnCode result = DoFetch(inOutBuffer, inBufferLength, inOutRangeList, outReturnedBytesCount, &lane);
+    
+    if (mTraceFunction)
+    {
+        mTraceFunction(mTraceContext, LockFreeQueueTrace_fetch, result == LockFreeQueue_OK ? *outReturnedBytesCount : inBufferLength, lane, result);
+    }
+    
+    if (outLane)
+    {
+        *outLane = lane;
+    }
+    
+    return result;
+}
+
+LockFreeQueueReturnCode LockFreeQueue::DoFetch(char *inOutBuffer, unsigned long inBufferLength, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount, unsigned long * outLane)
+{
+    if (mIsBroadcast)
+    {
+        printf("fetch: use FetchBroadcast in broadcast mode!\n");
+        *outReturnedBytesCount = 0;
+        return LockFreeQueue_notSubscribed;
+    }
+    
+    // look at the spill first, so every ring blob stored before the spill record is in oldRangeList
+    SpillRecordHeader *spillRecord = mSpillDirectory ? NextSpillRecord() : NULL;
+    
     OSMemoryBarrier();
     RangeList *oldRangeList = (RangeList*)mRangeList;
     
@@ -164,14 +344,35 @@ LockFreeQueueReturnCode LockFreeQueue::Fetch(char *inOutBuffer, unsigned long in
         return LockFreeQueue_rangeListInUse;
     }
     
-    if (oldRangeList->mFullRangeCount == 0)
+    // spilled blobs only compete with lane 0. Without higher lanes pending mFullRanges[0] is the
+    // oldest lane 0 blob not yet fetched, its sequence tells if it is older than the spill record
+    if (spillRecord
+        && (oldRangeList->mPendingLaneMask & ~1ul) == 0
+        && (oldRangeList->mFullRangeCount == 0 || oldRangeList->mFirstFullRangeSequence >= spillRecord->mRingStoreCount))
+    {
+        return FetchSpillRecord(spillRecord, inOutBuffer, inBufferLength, oldRangeList, inOutRangeList, outReturnedBytesCount);
+    }
+    
+    if (oldRangeList->mPendingLaneMask == 0)
     {
         // nothing to fetch!
         *outReturnedBytesCount = 0;
         return LockFreeQueue_empty;
     }
 
-    if (oldRangeList->mFullRanges[0].mLength > inBufferLength)
+    unsigned long lane = HighestPendingLaneWithList(oldRangeList);
+    unsigned long index = FirstPendingRangeIndexInLaneWithList(oldRangeList, lane);
+    
+    if (index == oldRangeList->mFullRangeCount)
+    {
+        printf("something is strange! (lane %d is marked pending but has no range)\n", (int)lane);
+        *outReturnedBytesCount = 0;
+        return LockFreeQueue_fileABug;
+    }
+    
+    Range fetchedRange = oldRangeList->mFullRanges[index];
+    
+    if (fetchedRange.mLength > inBufferLength)
     {
         printf("inBuffer not large enough!\n");
         *outReturnedBytesCount = 0;
@@ -181,7 +382,7 @@ LockFreeQueueReturnCode LockFreeQueue::Fetch(char *inOutBuffer, unsigned long in
     Range firstRange;
     Range secondRange;
     
-    RangePartsOfByteRange(&firstRange, &secondRange, &oldRangeList->mFullRanges[0]);
+    RangePartsOfByteRange(&firstRange, &secondRange, &fetchedRange);
     
     const bool doClearBuffer = true;
     
@@ -192,15 +393,17 @@ LockFreeQueueReturnCode LockFreeQueue::Fetch(char *inOutBuffer, unsigned long in
         memcpy(&inOutBuffer[firstRange.mLength], &mDataRing[secondRange.mPosition], secondRange.mLength);
     }
 
-    inOutRangeList->mHasReserved = oldRangeList->mHasReserved;
-    inOutRangeList->mReservedRange = oldRangeList->mReservedRange;
-    for (unsigned long i=0; i+1<oldRangeList->mFullRangeCount ; i++)
+    memcpy(inOutRangeList, oldRangeList, sizeof(RangeList));
+    
+    inOutRangeList->mFullRangeFetched[index] = true;
+    inOutRangeList->mPendingLaneCounts[lane]--;
+    if (inOutRangeList->mPendingLaneCounts[lane] == 0)
     {
-        inOutRangeList->mFullRanges[i] = oldRangeList->mFullRanges[i+1];
+        inOutRangeList->mPendingLaneMask &= ~(1ul << lane);
     }
-    inOutRangeList->mFullRangeCount = oldRangeList->mFullRangeCount-1;
+    DropFetchedRangesWithList(inOutRangeList);
     
-    bool result = OSAtomicCompareAndSwapPtr(oldRangeList, inOutRangeList, (void* volatile*)&mRangeList);
+    bool result = SwapRangeList(oldRangeList, inOutRangeList);
     
     if (result && doClearBuffer)
     {
@@ -208,7 +411,8 @@ LockFreeQueueReturnCode LockFreeQueue::Fetch(char *inOutBuffer, unsigned long in
         if (secondRange.mLength) memset(&mDataRing[secondRange.mPosition], '-', secondRange.mLength);
     }
     
-    *outReturnedBytesCount = result ? oldRangeList->mFullRanges[0].mLength : 0;
+    *outReturnedBytesCount = result ? fetchedRange.mLength : 0;
+    *outLane = lane;
     return result ? LockFreeQueue_OK : LockFreeQueue_casUnsuccessful;
 }
 
@@ -235,7 +439,7 @@ LockFreeQueueReturnCode LockFreeQueue::InternalizeRangeList(RangeList* inRangeLi
 
     memcpy(&mInternalRangeList, oldRangeList, sizeof(RangeList));
     
-    bool result = OSAtomicCompareAndSwapPtr(oldRangeList, &mInternalRangeList, (void* volatile*)&mRangeList);
+    bool result = SwapRangeList(oldRangeList, &mInternalRangeList);
     
     return result ? LockFreeQueue_OK : LockFreeQueue_casUnsuccessful;
 }
@@ -244,11 +448,36 @@ LockFreeQueueReturnCode LockFreeQueue::InternalizeRangeList(RangeList* inRangeLi
  \brief use this method to reserve a blob of data to fill.
  \param inCount count of bytes you need to reserve
  \param inOutRangeList RangeList to hold new state
+ \param inLane priority lane the blob is stored into. Fetch prefers higher lanes, default is 0.
  
  This method should only be called from the storing thread
  */
-LockFreeQueueReturnCode    LockFreeQueue::ReserveRange(unsigned long inCount, RangeList* inOutRangeList)
+LockFreeQueueReturnCode    LockFreeQueue::ReserveRange(unsigned long inCount, RangeList* inOutRangeList, unsigned long inLane)
 {
+    LockFreeQueueReturnCode result = DoReserveRange(inCount, inOutRangeList, inLane);
+    
+    if (mTraceFunction)
+    {
+        mTraceFunction(mTraceContext, LockFreeQueueTrace_reserveRange, inCount, inLane, result);
+    }
+    
+    return result;
+}
+
+LockFreeQueueReturnCode    LockFreeQueue::DoReserveRange(unsigned long inCount, RangeList* inOutRangeList, unsigned long inLane)
+{
+    if (inLane >= kLaneCount)
+    {
+        printf("reserve: no such lane!\n");
+        return LockFreeQueue_invalidLane;
+    }
+    
+    if (inCount > mDataRingLength)
+    {
+        // would never fit, and must not make broadcast mode detach subscribers
+        return LockFreeQueue_notEnoughSpaceLeft;
+    }
+    
     OSMemoryBarrier();
 
     RangeList *oldRangeList = (RangeList*)mRangeList;
@@ -267,13 +496,19 @@ LockFreeQueueReturnCode    LockFreeQueue::ReserveRange(unsigned long inCount, Ra
             return LockFreeQueue_alreadyReserved;
         }
         
-        if (FreeBytesWithList(oldRangeList) < inCount)
+        memcpy(inOutRangeList, oldRangeList, sizeof(RangeList));
+        
+        if (mIsBroadcast)
+        {
+            DropBroadcastRangesWithList(inOutRangeList, inCount);
+        }
+        
+        if (FreeBytesWithList(inOutRangeList) < inCount
+            || inOutRangeList->mFullRangeCount >= kMaxMessageCount)
         {
             // not enough space!
             return LockFreeQueue_notEnoughSpaceLeft;
         }
-        
-        memcpy(inOutRangeList, oldRangeList, sizeof(RangeList));
     }
     else
     {
@@ -283,9 +518,10 @@ LockFreeQueueReturnCode    LockFreeQueue::ReserveRange(unsigned long inCount, Ra
     unsigned long firstReserved = FirstEmptyByteIndexWithList(inOutRangeList);
     inOutRangeList->mReservedRange.mPosition = firstReserved;
     inOutRangeList->mReservedRange.mLength = inCount;
+    inOutRangeList->mReservedLane = inLane;
     inOutRangeList->mHasReserved = true;
     
-    bool result = OSAtomicCompareAndSwapPtr(oldRangeList, inOutRangeList, (void* volatile*)&mRangeList);
+    bool result = SwapRangeList(oldRangeList, inOutRangeList);
     
     if (result && true)
     {
@@ -308,6 +544,288 @@ LockFreeQueueReturnCode    LockFreeQueue::ReserveRange(unsigned long inCount, Ra
     return result ? LockFreeQueue_OK : LockFreeQueue_casUnsuccessful;
 }
 
+/**
+ \brief Append a blob of data to the spill files
+ \param inBufferToSpill buffer to spill
+ \param inBufferLength length of supplied buffer in inBufferToSpill
+ 
+ Use this when ReserveRange returns LockFreeQueue_notEnoughSpaceLeft. It touches the disk,
+ so it's not meant for a real-time thread. The blob is fetched in store order after the
+ blobs already in the ring. Blobs longer than the ring can't be spilled either.
+ 
+ Spilled blobs have no lane, they are fetched like lane 0 blobs. Don't spill blobs meant
+ for a higher lane, keep retrying ReserveRange for them instead.
+ 
+ This method should only be called from the storing thread
+ */
+LockFreeQueueReturnCode LockFreeQueue::Spill(const char *inBufferToSpill, unsigned long inBufferLength)
+{
+    if (!mSpillDirectory || mIsBroadcast)
+    {
+        return LockFreeQueue_spillFailed;
+    }
+    
+    if (inBufferLength > mDataRingLength)
+    {
+        return LockFreeQueue_notEnoughSpaceLeft;
+    }
+    
+    unsigned long recordLength = SpillAlignedLength(sizeof(SpillRecordHeader) + inBufferLength);
+    
+    DeleteFetchedSpillSegments();
+    
+    SpillSegment *segment = mSpillWriteSegment;
+    
+    if (!segment || segment->mLength - segment->mWritePosition < recordLength)
+    {
+        SpillSegment *newSegment = NewSpillSegment(recordLength);
+        
+        if (!newSegment)
+        {
+            return LockFreeQueue_spillFailed;
+        }
+        
+        if (segment)
+        {
+            if (segment->mLength - segment->mWritePosition >= sizeof(SpillRecordHeader))
+            {
+                SpillRecordHeader *endRecord = (SpillRecordHeader*)&segment->mData[segment->mWritePosition];
+                endRecord->mLength = kSpillEndOfSegment;
+                endRecord->mRingStoreCount = 0;
+            }
+            segment->mNext = newSegment;
+        }
+        else
+        {
+            // the fetching thread doesn't look at it before mSpillStoreCount changes
+            mSpillOldestSegment = newSegment;
+            mSpillReadSegment = newSegment;
+        }
+        
+        segment = newSegment;
+        mSpillWriteSegment = newSegment;
+    }
+    
+    SpillRecordHeader *record = (SpillRecordHeader*)&segment->mData[segment->mWritePosition];
+    record->mLength = inBufferLength;
+    record->mRingStoreCount = mRingStoreCount;
+    memcpy(&segment->mData[segment->mWritePosition + sizeof(SpillRecordHeader)], inBufferToSpill, inBufferLength);
+    segment->mWritePosition += recordLength;
+    
+    OSMemoryBarrier();
+    mSpillStoreCount++;
+    
+    return LockFreeQueue_OK;
+}
+
+/**
+ \brief Delete the segment files the fetching thread is done with
+ 
+ Spill calls this, too. Call it when you want the disk space back and don't spill anymore.
+ It touches the disk, so it's not meant for a real-time thread.
+ 
+ This method should only be called from the storing thread
+ */
+void LockFreeQueue::DeleteFetchedSpillSegments()
+{
+    OSMemoryBarrier();
+    
+    SpillSegment *firstSegmentToKeep;
+    
+    if (mSpillFetchCount == mSpillStoreCount)
+    {
+        // everything is fetched, the fetching thread doesn't look at the segments until the next spill
+        firstSegmentToKeep = NULL;
+        mSpillReadSegment = NULL;
+        mSpillWriteSegment = NULL;
+    }
+    else
+    {
+        // the fetching thread has left every segment before the one it reads from
+        firstSegmentToKeep = mSpillReadSegment;
+    }
+    
+    while (mSpillOldestSegment != firstSegmentToKeep)
+    {
+        SpillSegment *next = mSpillOldestSegment->mNext;
+        DeleteSpillSegment(mSpillOldestSegment);
+        mSpillOldestSegment = next;
+    }
+}
+
+/**
+ \brief Register a new broadcast subscriber
+ \param outSubscriber subscriber index to pass to FetchBroadcast and Unsubscribe
+ 
+ The subscriber gets every blob stored after this call. It can be called from any thread.
+ */
+LockFreeQueueReturnCode LockFreeQueue::Subscribe(unsigned long *outSubscriber)
+{
+    if (!mIsBroadcast)
+    {
+        printf("subscribe: only in broadcast mode!\n");
+        return LockFreeQueue_notSubscribed;
+    }
+    
+    for (unsigned long i=0; i<kMaxSubscriberCount; i++)
+    {
+        BroadcastCursor *cursor = &mCursors[i];
+        long oldState = cursor->mState;
+        
+        if (BroadcastCursorState(oldState) != kBroadcastCursorFree)
+        {
+            continue;
+        }
+        
+        // a new generation, so the storing thread can't detach this subscriber for the slot's previous one
+        long claimedState = BroadcastCursorWithState(oldState + kBroadcastCursorGeneration, kBroadcastCursorClaimed);
+        
+        if (!OSAtomicCompareAndSwapLong(oldState, claimedState, &cursor->mState))
+        {
+            continue;
+        }
+        
+        int32_t version;
+        unsigned long nextSequence;
+        do
+        {
+            version = mRangeListVersion;
+            OSMemoryBarrier();
+            RangeList *rangeList = (RangeList*)mRangeList;
+            nextSequence = rangeList->mFirstFullRangeSequence + rangeList->mFullRangeCount;
+            OSMemoryBarrier();
+        } while (version != mRangeListVersion);
+        
+        cursor->mNextSequence = nextSequence;
+        OSMemoryBarrier();
+        cursor->mState = BroadcastCursorWithState(claimedState, kBroadcastCursorActive);
+        
+        *outSubscriber = i;
+        return LockFreeQueue_OK;
+    }
+    
+    return LockFreeQueue_noSubscriberSlotLeft;
+}
+
+/**
+ \brief Remove a broadcast subscriber
+ \param inSubscriber subscriber index returned by Subscribe
+ 
+ Also use this to give back the slot of a subscriber that was detached. It should be called
+ from the subscriber's thread.
+ */
+LockFreeQueueReturnCode LockFreeQueue::Unsubscribe(unsigned long inSubscriber)
+{
+    if (!mIsBroadcast || inSubscriber >= kMaxSubscriberCount || BroadcastCursorState(mCursors[inSubscriber].mState) == kBroadcastCursorFree)
+    {
+        return LockFreeQueue_notSubscribed;
+    }
+    
+    OSMemoryBarrier();
+    mCursors[inSubscriber].mState = BroadcastCursorWithState(mCursors[inSubscriber].mState, kBroadcastCursorFree);
+    
+    return LockFreeQueue_OK;
+}
+
+/**
+ \brief Fetch the next blob of data for one broadcast subscriber
+ \param inSubscriber subscriber index returned by Subscribe
+ \param inOutBuffer buffer to hold the fetched data
+ \param inBufferLength length of supplied buffer in inOutBuffer
+ \param outReturnedBytesCount count of bytes which are returned
+ 
+ Doesn't change the RangeList, so no RangeList needs to be supplied. The storing thread gives
+ back the space in ReserveRange. Returns LockFreeQueue_notSubscribed once the subscriber is
+ detached, and LockFreeQueue_casUnsuccessful if the storing thread swapped RangeLists while
+ this one was looking, just try again.
+ 
+ This method should only be called from the subscriber's thread
+ */
+LockFreeQueueReturnCode LockFreeQueue::FetchBroadcast(unsigned long inSubscriber, char *inOutBuffer, unsigned long inBufferLength, unsigned long * outReturnedBytesCount)
+{
+    *outReturnedBytesCount = 0;
+    
+    if (!mIsBroadcast)
+    {
+        printf("fetch: use Fetch if not in broadcast mode!\n");
+        return LockFreeQueue_notSubscribed;
+    }
+    
+    if (inSubscriber >= kMaxSubscriberCount)
+    {
+        return LockFreeQueue_notSubscribed;
+    }
+    
+    BroadcastCursor *cursor = &mCursors[inSubscriber];
+    
+    OSMemoryBarrier();
+    
+    if (BroadcastCursorState(cursor->mState) != kBroadcastCursorActive)
+    {
+        return LockFreeQueue_notSubscribed;
+    }
+    
+    // the storing thread writes into a RangeList as soon as it isn't the valid one anymore
+    int32_t version = mRangeListVersion;
+    OSMemoryBarrier();
+    RangeList *rangeList = (RangeList*)mRangeList;
+    unsigned long sequence = cursor->mNextSequence;
+    unsigned long firstSequence = rangeList->mFirstFullRangeSequence;
+    unsigned long fullRangeCount = rangeList->mFullRangeCount;
+    
+    if (sequence < firstSequence)
+    {
+        // blobs stored while Subscribe was running, they are gone already
+        sequence = firstSequence;
+    }
+    
+    if (sequence - firstSequence >= fullRangeCount)
+    {
+        // nothing to fetch!
+        return LockFreeQueue_empty;
+    }
+    
+    Range fetchedRange = rangeList->mFullRanges[sequence - firstSequence];
+    
+    OSMemoryBarrier();
+    if (version != mRangeListVersion)
+    {
+        // another RangeList was swapped in while we were reading, so this one may be half rewritten
+        return LockFreeQueue_casUnsuccessful;
+    }
+    
+    if (fetchedRange.mLength > inBufferLength)
+    {
+        printf("inBuffer not large enough!\n");
+        return LockFreeQueue_bufferToSmall;
+    }
+    
+    Range firstRange;
+    Range secondRange;
+    
+    RangePartsOfByteRange(&firstRange, &secondRange, &fetchedRange);
+    
+    memcpy(inOutBuffer, &mDataRing[firstRange.mPosition], firstRange.mLength);
+    
+    if (secondRange.mLength)
+    {
+        memcpy(&inOutBuffer[firstRange.mLength], &mDataRing[secondRange.mPosition], secondRange.mLength);
+    }
+    
+    OSMemoryBarrier();
+    
+    if (BroadcastCursorState(cursor->mState) != kBroadcastCursorActive)
+    {
+        // detached while copying, the bytes might be overwritten already
+        return LockFreeQueue_notSubscribed;
+    }
+    
+    cursor->mNextSequence = sequence + 1;
+    
+    *outReturnedBytesCount = fetchedRange.mLength;
+    return LockFreeQueue_OK;
+}
+
 /**
  \brief print the content of the data buffer and range list
  
@@ -319,7 +837,14 @@ void  LockFreeQueue::DebugPrintDataBufferList()
     printf("range list: [");
     for (unsigned long i=0; i<mRangeList->mFullRangeCount; i++)
     {
-        printf("%d,%d  ", (int)mRangeList->mFullRanges[i].mPosition, (int)mRangeList->mFullRanges[i].mLength);
+        if (mRangeList->mFullRangeLanes[i] == 0 && !mRangeList->mFullRangeFetched[i])
+        {
+            printf("%d,%d  ", (int)mRangeList->mFullRanges[i].mPosition, (int)mRangeList->mFullRanges[i].mLength);
+        }
+        else
+        {
+            printf("%d,%d@%d%s  ", (int)mRangeList->mFullRanges[i].mPosition, (int)mRangeList->mFullRanges[i].mLength, (int)mRangeList->mFullRangeLanes[i], mRangeList->mFullRangeFetched[i]?"x":"");
+        }
     }
     printf("] reserved: %s (%d,%d)\n", mRangeList->mHasReserved?"YES":"no", (int)mRangeList->mReservedRange.mPosition, (int)mRangeList->mReservedRange.mLength);
 }
@@ -382,7 +907,7 @@ void LockFreeQueue::FirstFreeByteRangeWithList(Range *outRange, RangeList* inRan
     
     outRange->mPosition =  FirstEmptyByteIndexWithList(inRangeList);
     
-    if (outRange->mPosition < FirstFullByteIndexWithList(inRangeList))
+    if (IsFreeByteRangeBeforeFirstFullByteWithList(inRangeList))
     {
         outRange->mLength = FirstFullByteIndexWithList(inRangeList) - outRange->mPosition;
     }
@@ -401,7 +926,7 @@ bool LockFreeQueue::SecondFreeByteRangeWithList(Range *outRange, RangeList* inRa
         return false;
     }
     
-    if (FirstEmptyByteIndexWithList(inRangeList) < FirstFullByteIndexWithList(inRangeList))
+    if (IsFreeByteRangeBeforeFirstFullByteWithList(inRangeList))
     {
         return false;
     }
@@ -456,3 +981,242 @@ unsigned long   LockFreeQueue::FirstFullByteIndexWithList(RangeList* inRangeList
     return inRangeList->mFullRanges[0].mPosition;
 }
 
+bool LockFreeQueue::SwapRangeList(RangeList* inOldRangeList, RangeList* inNewRangeList)
+{
+    bool result = OSAtomicCompareAndSwapPtr(inOldRangeList, inNewRangeList, (void* volatile*)&mRangeList);
+    
+    if (result)
+    {
+        // readers that don't swap in a RangeList of their own compare this before and after reading
+        OSAtomicIncrement32Barrier(&mRangeListVersion);
+    }
+    
+    return result;
+}
+
+bool LockFreeQueue::IsFreeByteRangeBeforeFirstFullByteWithList(RangeList* inRangeList)
+{
+    unsigned long firstEmpty = FirstEmptyByteIndexWithList(inRangeList);
+    unsigned long firstFull = FirstFullByteIndexWithList(inRangeList);
+    
+    // equal indexes are a completely full ring, or a ring that only holds empty blobs
+    return firstEmpty < firstFull || (firstEmpty == firstFull && inRangeList->mFullByteCount != 0);
+}
+
+unsigned long   LockFreeQueue::HighestPendingLaneWithList(RangeList* inRangeList)
+{
+    // only valid for a non-zero mask
+    return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(inRangeList->mPendingLaneMask);
+}
+
+unsigned long   LockFreeQueue::FirstPendingRangeIndexInLaneWithList(RangeList* inRangeList, unsigned long inLane)
+{
+    unsigned long index = 0;
+    
+    while (index < inRangeList->mFullRangeCount
+           && (inRangeList->mFullRangeFetched[index] || inRangeList->mFullRangeLanes[index] != inLane))
+    {
+        index++;
+    }
+    
+    return index;
+}
+
+void LockFreeQueue::DropFetchedRangesWithList(RangeList* inOutRangeList)
+{
+    unsigned long dropCount = 0;
+    
+    while (dropCount < inOutRangeList->mFullRangeCount && inOutRangeList->mFullRangeFetched[dropCount])
+    {
+        dropCount++;
+    }
+    
+    DropFirstRangesWithList(inOutRangeList, dropCount);
+}
+
+void LockFreeQueue::DropFirstRangesWithList(RangeList* inOutRangeList, unsigned long inCount)
+{
+    if (inCount == 0)
+    {
+        return;
+    }
+    
+    for (unsigned long i=0; i<inCount; i++)
+    {
+        inOutRangeList->mFullByteCount -= inOutRangeList->mFullRanges[i].mLength;
+        
+        if (inOutRangeList->mFullRangeFetched[i])
+        {
+            continue;
+        }
+        
+        unsigned long lane = inOutRangeList->mFullRangeLanes[i];
+        inOutRangeList->mPendingLaneCounts[lane]--;
+        if (inOutRangeList->mPendingLaneCounts[lane] == 0)
+        {
+            inOutRangeList->mPendingLaneMask &= ~(1ul << lane);
+        }
+    }
+    
+    for (unsigned long i=0; i+inCount<inOutRangeList->mFullRangeCount ; i++)
+    {
+        inOutRangeList->mFullRanges[i] = inOutRangeList->mFullRanges[i+inCount];
+        inOutRangeList->mFullRangeLanes[i] = inOutRangeList->mFullRangeLanes[i+inCount];
+        inOutRangeList->mFullRangeFetched[i] = inOutRangeList->mFullRangeFetched[i+inCount];
+    }
+    inOutRangeList->mFullRangeCount -= inCount;
+    inOutRangeList->mFirstFullRangeSequence += inCount;
+}
+
+void LockFreeQueue::DropBroadcastRangesWithList(RangeList* inOutRangeList, unsigned long inNeededBytes)
+{
+    for (;;)
+    {
+        unsigned long endSequence = inOutRangeList->mFirstFullRangeSequence + inOutRangeList->mFullRangeCount;
+        unsigned long slowestSequence = endSequence;
+        BroadcastCursor *slowestCursor = NULL;
+        long slowestState = 0;
+        
+        for (unsigned long i=0; i<kMaxSubscriberCount; i++)
+        {
+            OSMemoryBarrier();
+            long state = mCursors[i].mState;
+            
+            if (BroadcastCursorState(state) != kBroadcastCursorActive)
+            {
+                continue;
+            }
+            
+            // read after the state, so a sequence of a later generation can only be larger
+            OSMemoryBarrier();
+            unsigned long sequence = mCursors[i].mNextSequence;
+            if (sequence < slowestSequence)
+            {
+                slowestSequence = sequence;
+                slowestCursor = &mCursors[i];
+                slowestState = state;
+            }
+        }
+        
+        if (slowestSequence > inOutRangeList->mFirstFullRangeSequence)
+        {
+            DropFirstRangesWithList(inOutRangeList, slowestSequence - inOutRangeList->mFirstFullRangeSequence);
+        }
+        
+        // ReserveRange refuses blobs longer than the ring, so dropping every range always makes room
+        if (!mDoDetachLaggards || !slowestCursor || inNeededBytes > mDataRingLength
+            || (FreeBytesWithList(inOutRangeList) >= inNeededBytes && inOutRangeList->mFullRangeCount < kMaxMessageCount))
+        {
+            return;
+        }
+        
+        // detach before the bytes are given back, FetchBroadcast checks for it after copying.
+        // Fails if the slot was unsubscribed and maybe subscribed again in the meantime.
+        OSAtomicCompareAndSwapLong(slowestState, BroadcastCursorWithState(slowestState, kBroadcastCursorDetached), &slowestCursor->mState);
+        OSMemoryBarrier();
+    }
+}
+
+SpillSegment *LockFreeQueue::NewSpillSegment(unsigned long inMinBytes)
+{
+    SpillSegment *segment = (SpillSegment*)calloc(1, sizeof(SpillSegment));
+    
+    if (!segment)
+    {
+        return NULL;
+    }
+    
+    snprintf(segment->mPath, sizeof(segment->mPath), "%s/LockFreeQueue-XXXXXX", mSpillDirectory);
+    segment->mFileDescriptor = mkstemp(segment->mPath);
+    
+    if (segment->mFileDescriptor < 0)
+    {
+        printf("spill: can't create segment file in %s!\n", mSpillDirectory);
+        free(segment);
+        return NULL;
+    }
+    
+    segment->mLength = inMinBytes > mSpillSegmentBytes ? inMinBytes : mSpillSegmentBytes;
+    
+    void *data = MAP_FAILED;
+    if (ftruncate(segment->mFileDescriptor, segment->mLength) == 0)
+    {
+        data = mmap(NULL, segment->mLength, PROT_READ | PROT_WRITE, MAP_SHARED, segment->mFileDescriptor, 0);
+    }
+    
+    if (data == MAP_FAILED)
+    {
+        printf("spill: can't map segment file %s!\n", segment->mPath);
+        close(segment->mFileDescriptor);
+        unlink(segment->mPath);
+        free(segment);
+        return NULL;
+    }
+    
+    segment->mData = (unsigned char*)data;
+    return segment;
+}
+
+void LockFreeQueue::DeleteSpillSegment(SpillSegment *inSegment)
+{
+    munmap(inSegment->mData, inSegment->mLength);
+    close(inSegment->mFileDescriptor);
+    unlink(inSegment->mPath);
+    free(inSegment);
+}
+
+SpillRecordHeader *LockFreeQueue::NextSpillRecord()
+{
+    OSMemoryBarrier();
+    
+    if (mSpillFetchCount == mSpillStoreCount)
+    {
+        return NULL;
+    }
+    
+    // there is an unread record, so the storing thread has linked every segment up to it
+    SpillSegment *segment = mSpillReadSegment;
+    
+    while (segment->mLength - segment->mReadPosition < sizeof(SpillRecordHeader)
+           || ((SpillRecordHeader*)&segment->mData[segment->mReadPosition])->mLength == kSpillEndOfSegment)
+    {
+        segment = segment->mNext;
+        
+        // done with the previous segment, the storing thread deletes it from now on
+        OSMemoryBarrier();
+        mSpillReadSegment = segment;
+    }
+    
+    return (SpillRecordHeader*)&segment->mData[segment->mReadPosition];
+}
+
+LockFreeQueueReturnCode LockFreeQueue::FetchSpillRecord(SpillRecordHeader *inRecord, char *inOutBuffer, unsigned long inBufferLength, RangeList* inOldRangeList, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount)
+{
+    if (inRecord->mLength > inBufferLength)
+    {
+        printf("inBuffer not large enough!\n");
+        *outReturnedBytesCount = 0;
+        return LockFreeQueue_bufferToSmall;
+    }
+    
+    // the ring is untouched, but callers rely on inOutRangeList being the valid one after a fetch
+    memcpy(inOutRangeList, inOldRangeList, sizeof(RangeList));
+    
+    if (!SwapRangeList(inOldRangeList, inOutRangeList))
+    {
+        *outReturnedBytesCount = 0;
+        return LockFreeQueue_casUnsuccessful;
+    }
+    
+    SpillSegment *segment = mSpillReadSegment;
+    
+    memcpy(inOutBuffer, &inRecord[1], inRecord->mLength);
+    *outReturnedBytesCount = inRecord->mLength;
+    segment->mReadPosition += SpillAlignedLength(sizeof(SpillRecordHeader) + inRecord->mLength);
+    
+    // the segment must not be touched after this, the storing thread may delete it
+    OSMemoryBarrier();
+    mSpillFetchCount++;
+    
+    return LockFreeQueue_OK;
+}
@@ -31,7 +31,11 @@
 #ifndef __LockFreeQueue__
 #define __LockFreeQueue__
 
+#include <stdint.h>
+
 const static unsigned long kMaxMessageCount = 100; //!< hardcoded max messge the RangeList can hold 
+const static unsigned long kLaneCount = 4; //!< count of priority lanes. Must not exceed the bit count of unsigned long.
+const static unsigned long kMaxSubscriberCount = 8; //!< hardcoded max count of broadcast subscribers
 
 /// \enum LockFreeQueueReturnCode
 /// \brief return code
@@ -46,9 +50,25 @@ typedef enum
     LockFreeQueue_differentByteCountThanReserved,        //!< can't store, you try to store a different count of bytes than you reserved
     LockFreeQueue_rangeListInUse,       //!< operation unsuccessful, supplied RangeList is in use
     LockFreeQueue_casUnsuccessful,      //!< operation unsuccessful, CAS operation was unsuccessful, try again.
+    LockFreeQueue_invalidLane,          //!< can't reserve space, the lane is not smaller than kLaneCount
+    LockFreeQueue_spillFailed,          //!< can't spill, spilling is not enabled or the spill file could not be written
+    LockFreeQueue_noSubscriberSlotLeft, //!< can't subscribe, already kMaxSubscriberCount subscribers
+    LockFreeQueue_notSubscribed,        //!< can't fetch, not subscribed, detached for lagging behind, or the wrong fetch for the queue's mode
     LockFreeQueue_fileABug              //!< operation failed in a way that might justify filing a bug report.
 } LockFreeQueueReturnCode;
 
+/// \enum LockFreeQueueTraceOperation
+/// \brief traced LockFreeQueue method
+typedef enum
+{
+    LockFreeQueueTrace_reserveRange = 0,
+    LockFreeQueueTrace_store,
+    LockFreeQueueTrace_fetch
+} LockFreeQueueTraceOperation;
+
+/// \brief Called after every traced call, see LockFreeQueue::SetTraceFunction.
+typedef void (*LockFreeQueueTraceFunction)(void *inContext, LockFreeQueueTraceOperation inOperation, unsigned long inByteCount, unsigned long inLane, LockFreeQueueReturnCode inReturnCode);
+
 /// Range of elements.
 typedef struct {
     unsigned long mPosition; //!< position of the first element of the range
@@ -62,17 +82,38 @@ typedef struct {
 /// are responsible to supply such a structure for all calls and keep it save while
 /// the LockFreeQueue is live. You can't supply the same RngeList multiple times
 /// i.e. you can't supply the valid RangeList again.
+///
+/// Full ranges are kept in store order no matter which lane they belong to, so
+/// the ring stays one contiguous run of bytes. A range fetched out of order is only
+/// marked as fetched and its bytes are given back once all older ranges are fetched, too.
 typedef struct {
     bool mHasReserved;      //!< if true mReservedRange is a actually a valid range you can put data into
     Range mReservedRange;   //!< range you can put data into
+    unsigned long mReservedLane;    //!< lane the reserved range is stored into
     unsigned long mFullRangeCount;  //!< count of valid full ranges
+    unsigned long mFirstFullRangeSequence; //!< sequence number of mFullRanges[0], i.e. count of ranges dropped so far
+    unsigned long mFullByteCount;   //!< sum of the lengths of the full ranges, tells a full ring from one that only holds empty blobs
     Range mFullRanges[kMaxMessageCount]; //!< full ranges
+    unsigned char mFullRangeLanes[kMaxMessageCount]; //!< lane of each full range
+    bool mFullRangeFetched[kMaxMessageCount]; //!< if true the full range is already fetched and only waits for the older ones
+    unsigned long mPendingLaneMask; //!< bit n is set if lane n has at least one full range that is not fetched
+    unsigned long mPendingLaneCounts[kLaneCount]; //!< count of full ranges per lane that are not fetched
 } RangeList;
 
+/// \brief Read position of one broadcast subscriber.
+typedef struct {
+    volatile long mState;   //!< free, claimed, active or detached in the low two bits, generation above. CASed!
+    volatile unsigned long mNextSequence; //!< sequence number of the next range to fetch, written by the subscriber only
+} BroadcastCursor;
+
+struct SpillSegment;
+struct SpillRecordHeader;
+
 class LockFreeQueue
 {
 private:
     RangeList  * volatile mRangeList; // CASed!
+    volatile int32_t mRangeListVersion; // incremented after every successful swap of mRangeList
     
     RangeList mInternalRangeList;
 
@@ -80,20 +121,53 @@ private:
     unsigned long mDataRingLength;
     bool  mDoOverwrite;
     
+    unsigned long mRingStoreCount;      // storing thread only
+    
+    char *mSpillDirectory;              // NULL if spilling is not enabled
+    unsigned long mSpillSegmentBytes;
+    SpillSegment *mSpillOldestSegment;  // storing thread only, first segment not deleted yet
+    SpillSegment *mSpillWriteSegment;   // storing thread only
+    SpillSegment * volatile mSpillReadSegment;  // set by the storing thread when there is no segment, then advanced by the fetching thread
+    volatile unsigned long mSpillStoreCount; // written by the storing thread
+    volatile unsigned long mSpillFetchCount; // written by the fetching thread
+    
+    bool mIsBroadcast;
+    bool mDoDetachLaggards;
+    BroadcastCursor mCursors[kMaxSubscriberCount];
+    
+    LockFreeQueueTraceFunction mTraceFunction; // NULL if not tracing
+    void *mTraceContext;
+    
 public:
 	LockFreeQueue();
 	~LockFreeQueue();
     void InitWithMaxBytesDoOverwrite(unsigned long maxBytes, bool doOverwrite);
+    void InitSpillWithDirectorySegmentBytes(const char *inDirectory, unsigned long inSegmentBytes);
+    void InitBroadcastDoDetachLaggards(bool doDetachLaggards);
+    void SetTraceFunction(LockFreeQueueTraceFunction inFunction, void *inContext);
 
     // list-based
-    LockFreeQueueReturnCode     ReserveRange(unsigned long inCount, RangeList* inOutRangeList);
+    LockFreeQueueReturnCode     ReserveRange(unsigned long inCount, RangeList* inOutRangeList, unsigned long inLane = 0);
     LockFreeQueueReturnCode     Store(const char *inBufferToStore, unsigned long inBufferLength, RangeList* inReservedList, RangeList* inOutRangeList);
-    LockFreeQueueReturnCode     Fetch(char *inOutBuffer, unsigned long inBufferLength, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount);
+    LockFreeQueueReturnCode     Fetch(char *inOutBuffer, unsigned long inBufferLength, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount, unsigned long * outLane = 0);
     LockFreeQueueReturnCode     InternalizeRangeList(RangeList* inRangeList);
     void                        DebugPrintDataBufferList();
     
+    // spill
+    LockFreeQueueReturnCode     Spill(const char *inBufferToSpill, unsigned long inBufferLength);
+    void                        DeleteFetchedSpillSegments();
+    
+    // broadcast
+    LockFreeQueueReturnCode     Subscribe(unsigned long *outSubscriber);
+    LockFreeQueueReturnCode     Unsubscribe(unsigned long inSubscriber);
+    LockFreeQueueReturnCode     FetchBroadcast(unsigned long inSubscriber, char *inOutBuffer, unsigned long inBufferLength, unsigned long * outReturnedBytesCount);
+    
 private:
 
+    LockFreeQueueReturnCode     DoReserveRange(unsigned long inCount, RangeList* inOutRangeList, unsigned long inLane);
+    LockFreeQueueReturnCode     DoStore(const char *inBufferToStore, unsigned long inBufferLength, RangeList* inReservedList, RangeList* inOutRangeList);
+    LockFreeQueueReturnCode     DoFetch(char *inOutBuffer, unsigned long inBufferLength, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount, unsigned long * outLane);
+    
     void            RangePartsOfByteRange(Range *outFirstRange, Range *outSecondRange, Range *inRange);
     unsigned long   EffectiveFirstDataByteIndexAfterRange(Range *inRange);
      
@@ -102,6 +176,19 @@ private:
     unsigned long   FreeBytesWithList(RangeList* inRangeList);
     unsigned long   FirstEmptyByteIndexWithList(RangeList* inRangeList);
     unsigned long   FirstFullByteIndexWithList(RangeList* inRangeList);
+    bool            SwapRangeList(RangeList* inOldRangeList, RangeList* inNewRangeList);
+    bool            IsFreeByteRangeBeforeFirstFullByteWithList(RangeList* inRangeList);
+
+    unsigned long   HighestPendingLaneWithList(RangeList* inRangeList);
+    unsigned long   FirstPendingRangeIndexInLaneWithList(RangeList* inRangeList, unsigned long inLane);
+    void            DropFetchedRangesWithList(RangeList* inOutRangeList);
+    void            DropFirstRangesWithList(RangeList* inOutRangeList, unsigned long inCount);
+    void            DropBroadcastRangesWithList(RangeList* inOutRangeList, unsigned long inNeededBytes);
+    
+    SpillSegment *  NewSpillSegment(unsigned long inMinBytes);
+    void            DeleteSpillSegment(SpillSegment *inSegment);
+    SpillRecordHeader * NextSpillRecord();
+    LockFreeQueueReturnCode FetchSpillRecord(SpillRecordHeader *inRecord, char *inOutBuffer, unsigned long inBufferLength, RangeList* inOldRangeList, RangeList* inOutRangeList, unsigned long * outReturnedBytesCount);
 };
 
 #endif /* defined(__LockFreeQueue__) */
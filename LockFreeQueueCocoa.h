@@ -37,9 +37,11 @@
 @interface LockFreeQueueCocoa : NSObject
 
 - (id) initWithSize:(unsigned long)inSize;
+- (id) initWithSize:(unsigned long)inSize spillDirectory:(NSString*)inDirectory segmentSize:(unsigned long)inSegmentSize;
 
 - (NSData*) fetchData;
 - (BOOL) storeData:(NSData*)inData;
+- (BOOL) storeData:(NSData*)inData lane:(unsigned long)inLane;
 
 - (void*)lockFreeQueueVoid;
 
@@ -76,6 +76,21 @@
     return self;
 }
 
+/**
+ \brief init with spilling to memory-mapped files in inDirectory
+ 
+ storeData: then spills lane 0 packets to disk when the queue is full instead of failing.
+ */
+- (id) initWithSize:(unsigned long)inSize spillDirectory:(NSString*)inDirectory segmentSize:(unsigned long)inSegmentSize;
+{
+    if (!(self=[self initWithSize:inSize]))
+        return nil;
+    
+    self.lockFreeQueue->InitSpillWithDirectorySegmentBytes([inDirectory fileSystemRepresentation], inSegmentSize);
+    
+    return self;
+}
+
 - (void) dealloc
 {
     while (self.lockFreeQueue->InternalizeRangeList(_reserveRangeList) == LockFreeQueue_casUnsuccessful)
@@ -101,7 +116,7 @@
     free(_fetchRangeListB);
     free(_fetchBuffer);
     
-    free(_lockFreeQueue);
+    delete _lockFreeQueue;
 
 #if !__has_feature(objc_arc)
     [super dealloc];
@@ -141,14 +156,30 @@
  */
 - (BOOL) storeData:(NSData*)inData;
 {
-    LockFreeQueueReturnCode returnCode = self.lockFreeQueue->ReserveRange(inData.length, self.reserveRangeList);
+    return [self storeData:inData lane:0];
+}
+
+/**
+ \brief store one packet of data into a priority lane
+ 
+ fetchData returns packets of higher lanes first. **CAUTION** this can block!
+ */
+- (BOOL) storeData:(NSData*)inData lane:(unsigned long)inLane;
+{
+    LockFreeQueueReturnCode returnCode = self.lockFreeQueue->ReserveRange(inData.length, self.reserveRangeList, inLane);
     
+    NSAssert(returnCode != LockFreeQueue_invalidLane, @"no such lane!");
     NSAssert(returnCode != LockFreeQueue_alreadyReserved, @"reserved twice!");
     NSAssert(returnCode != LockFreeQueue_fileABug, @"file a bug!");
     NSAssert(returnCode != LockFreeQueue_rangeListInUse, @"range list in use!");
     
-    if (returnCode == LockFreeQueue_notEnoughSpaceLeft ||
-        returnCode == LockFreeQueue_casUnsuccessful)
+    if (returnCode == LockFreeQueue_notEnoughSpaceLeft)
+    {
+        // spilled blobs lose their lane, so only lane 0 spills
+        return inLane == 0 && self.lockFreeQueue->Spill((const char*)[inData bytes], [inData length]) == LockFreeQueue_OK;
+    }
+    
+    if (returnCode == LockFreeQueue_casUnsuccessful)
     {
         return NO;
     }
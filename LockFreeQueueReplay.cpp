@@ -0,0 +1,454 @@
+//
+//  LockFreeQueueReplay.cpp
+//
+//  Created by agent on 19.10.26.
+//
+// Copyright (c) 2026, agent
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+//  Replays a trace file written by LockFreeQueueTracer against a fresh LockFreeQueue and
+//  reports throughput and latency. Build with
+//
+//      c++ -O2 -o LockFreeQueueReplay LockFreeQueueReplay.cpp LockFreeQueue.cpp LockFreeQueueTrace.cpp
+//
+//  and run
+//
+//      LockFreeQueueReplay <trace file> [ring length] [speedup]
+//
+
+#include "LockFreeQueue.h"
+#include "LockFreeQueueTrace.h"
+
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// \brief One call to replay.
+typedef struct {
+    uint64_t mTime;             //!< nanoseconds after the first traced call, already divided by the speedup
+    unsigned long mByteCount;   //!< bytes to store, unused for fetches
+    unsigned long mLane;        //!< lane to store into, unused for fetches
+} ReplayEvent;
+
+/// \brief State shared by the replay threads.
+typedef struct {
+    LockFreeQueue *mQueue;
+    unsigned long mDataRingLength;
+    
+    ReplayEvent *mStoreEvents;
+    unsigned long mStoreEventCount;
+    ReplayEvent *mFetchEvents;
+    unsigned long mFetchEventCount;
+    
+    mach_timebase_info_data_t mTimebase;
+    uint64_t mStartTime;                // mach_absolute_time() of the first event
+    
+    uint64_t *mStoreTimes;              // mach_absolute_time() of every stored blob by sequence, written by the storing thread
+    unsigned long *mLaneSequences[kLaneCount]; // sequences of the stored blobs of each lane in store order, written by the storing thread
+    unsigned long mLaneStoredCounts[kLaneCount];    // storing thread only
+    unsigned long mLaneFetchedCounts[kLaneCount];   // fetching thread only, lanes keep their order so this pairs fetches with sequences
+    uint64_t *mLatencies;               // nanoseconds from store to fetch of every fetched blob
+    volatile unsigned long mStoredCount;
+    volatile unsigned long mFetchedCount;
+    volatile bool mIsStoringDone;
+    
+    unsigned long mRejectedCount;       // not enough space left
+    unsigned long mStoredBytes;
+    unsigned long mFetchedBytes;
+    unsigned long mDrainedCount;        // fetched after the traced fetches ran out
+    unsigned long mPeakMessageCount;
+    uint64_t mEndTime;
+} Replay;
+
+static int CompareRecords(const void *inFirst, const void *inSecond)
+{
+    const LockFreeQueueTraceRecord *first = (const LockFreeQueueTraceRecord*)inFirst;
+    const LockFreeQueueTraceRecord *second = (const LockFreeQueueTraceRecord*)inSecond;
+    
+    if (first->mTimestamp != second->mTimestamp)
+    {
+        return first->mTimestamp < second->mTimestamp ? -1 : 1;
+    }
+    
+    // records of one thread never share a timestamp in practice, keep the file order otherwise
+    return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+static int CompareLatencies(const void *inFirst, const void *inSecond)
+{
+    uint64_t first = *(const uint64_t*)inFirst;
+    uint64_t second = *(const uint64_t*)inSecond;
+    
+    return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+static uint64_t NanosecondsFromTicks(uint64_t inTicks, mach_timebase_info_data_t *inTimebase)
+{
+    return inTicks * inTimebase->numer / inTimebase->denom;
+}
+
+static uint64_t TicksFromNanoseconds(uint64_t inNanoseconds, mach_timebase_info_data_t *inTimebase)
+{
+    return inNanoseconds * inTimebase->denom / inTimebase->numer;
+}
+
+static void WaitUntil(uint64_t inTime, mach_timebase_info_data_t *inTimebase)
+{
+    for (;;)
+    {
+        uint64_t now = mach_absolute_time();
+        
+        if (now >= inTime)
+        {
+            return;
+        }
+        
+        // sleep through long gaps, spin through the last millisecond but let the other thread run
+        uint64_t nanoseconds = NanosecondsFromTicks(inTime - now, inTimebase);
+        if (nanoseconds > 2000000)
+        {
+            usleep((useconds_t)((nanoseconds - 1000000) / 1000));
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ \brief Read a trace file and turn it into store and fetch events
+ 
+ A ReserveRange that failed because of a concurrent call (casUnsuccessful, alreadyReserved)
+ and is followed by one of the same size and lane is taken as a retry of the same blob, so
+ that blob counts once, at the time it was offered first. Any other failure, like
+ notEnoughSpaceLeft, is an offer of its own.
+ */
+static bool ReadTrace(const char *inPath, double inSpeedup, Replay *outReplay, LockFreeQueueTraceFileHeader *outHeader)
+{
+    FILE *file = fopen(inPath, "rb");
+    
+    if (!file)
+    {
+        printf("can't open %s!\n", inPath);
+        return false;
+    }
+    
+    if (fread(outHeader, sizeof(LockFreeQueueTraceFileHeader), 1, file) != 1
+        || memcmp(outHeader->mMagic, "LFQT", 4) != 0
+        || outHeader->mVersion != kLockFreeQueueTraceVersion)
+    {
+        printf("%s is not a trace file!\n", inPath);
+        fclose(file);
+        return false;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    unsigned long recordCount = (ftell(file) - sizeof(LockFreeQueueTraceFileHeader)) / sizeof(LockFreeQueueTraceRecord);
+    fseek(file, sizeof(LockFreeQueueTraceFileHeader), SEEK_SET);
+    
+    LockFreeQueueTraceRecord *records = (LockFreeQueueTraceRecord*)malloc((recordCount + 1) * sizeof(LockFreeQueueTraceRecord));
+    recordCount = fread(records, sizeof(LockFreeQueueTraceRecord), recordCount, file);
+    fclose(file);
+    
+    qsort(records, recordCount, sizeof(LockFreeQueueTraceRecord), CompareRecords);
+    
+    outReplay->mStoreEvents = (ReplayEvent*)malloc((recordCount + 1) * sizeof(ReplayEvent));
+    outReplay->mFetchEvents = (ReplayEvent*)malloc((recordCount + 1) * sizeof(ReplayEvent));
+    outReplay->mStoreEventCount = 0;
+    outReplay->mFetchEventCount = 0;
+    
+    mach_timebase_info_data_t traceTimebase;
+    traceTimebase.numer = outHeader->mTimebaseNumer;
+    traceTimebase.denom = outHeader->mTimebaseDenom;
+    
+    uint64_t firstTimestamp = recordCount ? records[0].mTimestamp : 0;
+    bool isRetryPossible = false;
+    uint32_t lastReservedByteCount = 0;
+    uint8_t lastReservedLane = 0;
+    
+    for (unsigned long i=0; i<recordCount; i++)
+    {
+        LockFreeQueueTraceRecord *record = &records[i];
+        
+        ReplayEvent event;
+        event.mTime = (uint64_t)(NanosecondsFromTicks(record->mTimestamp - firstTimestamp, &traceTimebase) / inSpeedup);
+        event.mByteCount = record->mByteCount;
+        event.mLane = record->mLane < kLaneCount ? record->mLane : kLaneCount - 1;
+        
+        if (record->mOperation == LockFreeQueueTrace_reserveRange)
+        {
+            if (!(isRetryPossible && record->mByteCount == lastReservedByteCount && record->mLane == lastReservedLane))
+            {
+                outReplay->mStoreEvents[outReplay->mStoreEventCount++] = event;
+            }
+            
+            isRetryPossible = record->mReturnCode == LockFreeQueue_casUnsuccessful || record->mReturnCode == LockFreeQueue_alreadyReserved;
+            lastReservedByteCount = record->mByteCount;
+            lastReservedLane = record->mLane;
+        }
+        else if (record->mOperation == LockFreeQueueTrace_fetch)
+        {
+            outReplay->mFetchEvents[outReplay->mFetchEventCount++] = event;
+        }
+    }
+    
+    free(records);
+    
+    return true;
+}
+
+static void *StoringThread(void *inReplay)
+{
+    Replay *replay = (Replay*)inReplay;
+    LockFreeQueue *queue = replay->mQueue;
+    
+    RangeList reserveRangeList;
+    RangeList storeRangeList;
+    char *buffer = (char*)calloc(replay->mDataRingLength + 1, 1);
+    
+    for (unsigned long i=0; i<replay->mStoreEventCount; i++)
+    {
+        ReplayEvent *event = &replay->mStoreEvents[i];
+        WaitUntil(replay->mStartTime + TicksFromNanoseconds(event->mTime, &replay->mTimebase), &replay->mTimebase);
+        
+        LockFreeQueueReturnCode returnCode;
+        while ((returnCode = queue->ReserveRange(event->mByteCount, &reserveRangeList, event->mLane)) == LockFreeQueue_casUnsuccessful)
+            ;
+        
+        if (returnCode != LockFreeQueue_OK)
+        {
+            replay->mRejectedCount++;
+            continue;
+        }
+        
+        // the fetching thread reads these only after the Store CAS made the blob visible
+        unsigned long sequence = replay->mStoredCount;
+        replay->mStoreTimes[sequence] = mach_absolute_time();
+        replay->mLaneSequences[event->mLane][replay->mLaneStoredCounts[event->mLane]++] = sequence;
+        
+        while (queue->Store(buffer, event->mByteCount, &reserveRangeList, &storeRangeList) == LockFreeQueue_casUnsuccessful)
+            ;
+        
+        replay->mStoredBytes += event->mByteCount;
+        replay->mStoredCount++;
+        
+        OSMemoryBarrier();
+        unsigned long messageCount = replay->mStoredCount - replay->mFetchedCount;
+        if (messageCount > replay->mPeakMessageCount)
+        {
+            replay->mPeakMessageCount = messageCount;
+        }
+    }
+    
+    while (queue->InternalizeRangeList(&reserveRangeList) != LockFreeQueue_OK)
+        ;
+    while (queue->InternalizeRangeList(&storeRangeList) != LockFreeQueue_OK)
+        ;
+    
+    free(buffer);
+    
+    OSMemoryBarrier();
+    replay->mIsStoringDone = true;
+    
+    return NULL;
+}
+
+static void *FetchingThread(void *inReplay)
+{
+    Replay *replay = (Replay*)inReplay;
+    LockFreeQueue *queue = replay->mQueue;
+    
+    RangeList fetchRangeListA;
+    RangeList fetchRangeListB;
+    bool useANext = true;
+    char *buffer = (char*)malloc(replay->mDataRingLength + 1);
+    
+    unsigned long eventIndex = 0;
+    
+    for (;;)
+    {
+        bool isDraining = eventIndex >= replay->mFetchEventCount;
+        
+        if (isDraining)
+        {
+            OSMemoryBarrier();
+            if (replay->mIsStoringDone && replay->mFetchedCount == replay->mStoredCount)
+            {
+                break;
+            }
+        }
+        else
+        {
+            ReplayEvent *event = &replay->mFetchEvents[eventIndex++];
+            WaitUntil(replay->mStartTime + TicksFromNanoseconds(event->mTime, &replay->mTimebase), &replay->mTimebase);
+        }
+        
+        unsigned long returnedBytesCount = 0;
+        unsigned long lane = 0;
+        LockFreeQueueReturnCode returnCode;
+        while ((returnCode = queue->Fetch(buffer, replay->mDataRingLength, useANext ? &fetchRangeListA : &fetchRangeListB, &returnedBytesCount, &lane)) == LockFreeQueue_casUnsuccessful)
+            ;
+        
+        if (returnCode != LockFreeQueue_OK)
+        {
+            continue;
+        }
+        
+        uint64_t now = mach_absolute_time();
+        useANext = !useANext;
+        
+        // a higher lane overtakes older blobs, so pair with the oldest unfetched blob of the same lane
+        unsigned long sequence = replay->mLaneSequences[lane][replay->mLaneFetchedCounts[lane]++];
+        unsigned long fetchedCount = replay->mFetchedCount;
+        replay->mLatencies[fetchedCount] = NanosecondsFromTicks(now - replay->mStoreTimes[sequence], &replay->mTimebase);
+        replay->mFetchedBytes += returnedBytesCount;
+        replay->mDrainedCount += isDraining ? 1 : 0;
+        
+        OSMemoryBarrier();
+        replay->mFetchedCount = fetchedCount + 1;
+    }
+    
+    replay->mEndTime = mach_absolute_time();
+    
+    while (queue->InternalizeRangeList(&fetchRangeListA) != LockFreeQueue_OK)
+        ;
+    while (queue->InternalizeRangeList(&fetchRangeListB) != LockFreeQueue_OK)
+        ;
+    
+    free(buffer);
+    
+    return NULL;
+}
+
+static void PrintReport(Replay *inReplay, LockFreeQueueTraceFileHeader *inHeader, double inSpeedup)
+{
+    double seconds = NanosecondsFromTicks(inReplay->mEndTime - inReplay->mStartTime, &inReplay->mTimebase) / 1e9;
+    unsigned long fetchedCount = inReplay->mFetchedCount;
+    
+    printf("ring length:       %lu (traced with %llu)\n", inReplay->mDataRingLength, (unsigned long long)inHeader->mDataRingLength);
+    printf("kMaxMessageCount:  %lu (traced with %llu)\n", kMaxMessageCount, (unsigned long long)inHeader->mMaxMessageCount);
+    printf("speedup:           %g\n", inSpeedup);
+    printf("offered:           %lu blobs\n", inReplay->mStoreEventCount);
+    printf("stored:            %lu blobs, %lu bytes\n", (unsigned long)inReplay->mStoredCount, inReplay->mStoredBytes);
+    printf("rejected:          %lu blobs (not enough space left)\n", inReplay->mRejectedCount);
+    printf("fetched:           %lu blobs, %lu bytes, %lu of them after the traced fetches ran out\n", fetchedCount, inReplay->mFetchedBytes, inReplay->mDrainedCount);
+    printf("peak queued:       %lu blobs\n", inReplay->mPeakMessageCount);
+    printf("stored per lane:  ");
+    for (unsigned long i=0; i<kLaneCount; i++)
+    {
+        printf(" %lu: %lu", i, inReplay->mLaneStoredCounts[i]);
+    }
+    printf("\n");
+    
+    if (seconds > 0)
+    {
+        printf("throughput:        %.0f blobs/s, %.3f MB/s over %.3f s\n", fetchedCount / seconds, inReplay->mFetchedBytes / seconds / 1e6, seconds);
+    }
+    
+    if (fetchedCount)
+    {
+        qsort(inReplay->mLatencies, fetchedCount, sizeof(uint64_t), CompareLatencies);
+        
+        double sum = 0;
+        for (unsigned long i=0; i<fetchedCount; i++)
+        {
+            sum += inReplay->mLatencies[i];
+        }
+        
+        printf("latency (us):      min %.1f  mean %.1f  median %.1f  p99 %.1f  max %.1f\n",
+               inReplay->mLatencies[0] / 1e3,
+               sum / fetchedCount / 1e3,
+               inReplay->mLatencies[fetchedCount / 2] / 1e3,
+               inReplay->mLatencies[fetchedCount * 99 / 100] / 1e3,
+               inReplay->mLatencies[fetchedCount - 1] / 1e3);
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <trace file> [ring length] [speedup]\n", argv[0]);
+        return 1;
+    }
+    
+    double speedup = argc > 3 ? atof(argv[3]) : 1.0;
+    if (speedup <= 0)
+    {
+        printf("speedup must be larger than 0!\n");
+        return 1;
+    }
+    
+    Replay replay;
+    memset(&replay, 0, sizeof(replay));
+    
+    LockFreeQueueTraceFileHeader header;
+    if (!ReadTrace(argv[1], speedup, &replay, &header))
+    {
+        return 1;
+    }
+    
+    replay.mDataRingLength = argc > 2 ? strtoul(argv[2], NULL, 10) : (unsigned long)header.mDataRingLength;
+    replay.mStoreTimes = (uint64_t*)malloc((replay.mStoreEventCount + 1) * sizeof(uint64_t));
+    replay.mLatencies = (uint64_t*)malloc((replay.mStoreEventCount + 1) * sizeof(uint64_t));
+    for (unsigned long i=0; i<kLaneCount; i++)
+    {
+        replay.mLaneSequences[i] = (unsigned long*)malloc((replay.mStoreEventCount + 1) * sizeof(unsigned long));
+    }
+    mach_timebase_info(&replay.mTimebase);
+    
+    replay.mQueue = new LockFreeQueue();
+    replay.mQueue->InitWithMaxBytesDoOverwrite(replay.mDataRingLength, false);
+    
+    replay.mStartTime = mach_absolute_time();
+    
+    pthread_t storingThread;
+    pthread_t fetchingThread;
+    pthread_create(&storingThread, NULL, StoringThread, &replay);
+    pthread_create(&fetchingThread, NULL, FetchingThread, &replay);
+    pthread_join(storingThread, NULL);
+    pthread_join(fetchingThread, NULL);
+    
+    PrintReport(&replay, &header, speedup);
+    
+    delete replay.mQueue;
+    free(replay.mStoreEvents);
+    free(replay.mFetchEvents);
+    free(replay.mStoreTimes);
+    free(replay.mLatencies);
+    for (unsigned long i=0; i<kLaneCount; i++)
+    {
+        free(replay.mLaneSequences[i]);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,231 @@
+//
+//  LockFreeQueueTrace.cpp
+//
+//  Created by agent on 19.10.26.
+//
+// Copyright (c) 2026, agent
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+#include "LockFreeQueueTrace.h"
+
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <string.h>
+
+LockFreeQueueTracer::LockFreeQueueTracer()
+{
+    // Don't do any work here but use init
+}
+
+LockFreeQueueTracer::~LockFreeQueueTracer()
+{
+    if (mFile)
+    {
+        Flush();
+        fclose(mFile);
+        pthread_key_delete(mBufferKey);
+    }
+    free(mRecords);
+}
+
+#pragma mark - public
+
+/**
+ \brief Initialiser.
+ \param inPath path of the trace file. An existing file is overwritten.
+ \param inRecordsPerThread count of records each thread can hold until the next Flush
+ \param inDataRingLength ring length of the traced queue, goes into the file header
+ \return false if the trace file can't be created
+ */
+bool LockFreeQueueTracer::InitWithPathRecordsPerThread(const char *inPath, unsigned long inRecordsPerThread, unsigned long inDataRingLength)
+{
+    mRecordsPerThread = inRecordsPerThread;
+    mRecords = (LockFreeQueueTraceRecord*)calloc(kMaxTraceThreadCount * inRecordsPerThread, sizeof(LockFreeQueueTraceRecord));
+    mBufferCount = 0;
+    mThreadlessDroppedCount = 0;
+    
+    for (unsigned long i=0; i<kMaxTraceThreadCount; i++)
+    {
+        mWriteCounts[i] = 0;
+        mReadCounts[i] = 0;
+        mDroppedCounts[i] = 0;
+    }
+    
+    mFile = fopen(inPath, "wb");
+    
+    if (!mFile)
+    {
+        printf("trace: can't create %s!\n", inPath);
+        return false;
+    }
+    
+    pthread_key_create(&mBufferKey, NULL);
+    
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    
+    LockFreeQueueTraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.mMagic, "LFQT", 4);
+    header.mVersion = kLockFreeQueueTraceVersion;
+    header.mTimebaseNumer = timebase.numer;
+    header.mTimebaseDenom = timebase.denom;
+    header.mDataRingLength = inDataRingLength;
+    header.mMaxMessageCount = kMaxMessageCount;
+    
+    fwrite(&header, sizeof(header), 1, mFile);
+    
+    return true;
+}
+
+/**
+ \brief LockFreeQueueTraceFunction that records into a tracer
+ \param inTracer the LockFreeQueueTracer, pass it as context to LockFreeQueue::SetTraceFunction
+ */
+void LockFreeQueueTracer::TraceFunction(void *inTracer, LockFreeQueueTraceOperation inOperation, unsigned long inByteCount, unsigned long inLane, LockFreeQueueReturnCode inReturnCode)
+{
+    ((LockFreeQueueTracer*)inTracer)->Record(inOperation, inByteCount, inLane, inReturnCode);
+}
+
+/**
+ \brief Record one call
+ 
+ Called by LockFreeQueue. Safe on a real-time thread: the first call of a thread claims a
+ buffer with a single atomic increment, every call after that only writes into it.
+ */
+void LockFreeQueueTracer::Record(LockFreeQueueTraceOperation inOperation, unsigned long inByteCount, unsigned long inLane, LockFreeQueueReturnCode inReturnCode)
+{
+    unsigned long bufferIndex = (unsigned long)pthread_getspecific(mBufferKey);
+    
+    if (bufferIndex == 0)
+    {
+        bufferIndex = OSAtomicIncrement32(&mBufferCount);
+        
+        if (bufferIndex > kMaxTraceThreadCount)
+        {
+            bufferIndex = kMaxTraceThreadCount + 1;
+        }
+        
+        pthread_setspecific(mBufferKey, (void*)bufferIndex);
+    }
+    
+    if (bufferIndex > kMaxTraceThreadCount)
+    {
+        // too many threads
+        OSAtomicIncrement32(&mThreadlessDroppedCount);
+        return;
+    }
+    
+    bufferIndex--;
+    
+    unsigned long writeCount = mWriteCounts[bufferIndex];
+    
+    if (writeCount - mReadCounts[bufferIndex] >= mRecordsPerThread)
+    {
+        // buffer full, Flush isn't called often enough
+        mDroppedCounts[bufferIndex]++;
+        return;
+    }
+    
+    LockFreeQueueTraceRecord *record = &mRecords[bufferIndex * mRecordsPerThread + writeCount % mRecordsPerThread];
+    record->mTimestamp = mach_absolute_time();
+    record->mThread = (uint64_t)(uintptr_t)pthread_self();
+    record->mByteCount = (uint32_t)inByteCount;
+    record->mOperation = (uint8_t)inOperation;
+    record->mReturnCode = (uint8_t)inReturnCode;
+    record->mLane = (uint8_t)inLane;
+    record->mUnused = 0;
+    
+    OSMemoryBarrier();
+    mWriteCounts[bufferIndex] = writeCount + 1;
+}
+
+/**
+ \brief Write all recorded calls to the trace file
+ \return count of written records
+ 
+ Records of different threads are not sorted, sort them by timestamp when reading the file.
+ Call this regularly from one thread that is allowed to block, never from a traced real-time thread.
+ */
+unsigned long LockFreeQueueTracer::Flush()
+{
+    unsigned long result = 0;
+    
+    OSMemoryBarrier();
+    unsigned long bufferCount = (unsigned long)mBufferCount;
+    if (bufferCount > kMaxTraceThreadCount)
+    {
+        bufferCount = kMaxTraceThreadCount;
+    }
+    
+    for (unsigned long i=0; i<bufferCount; i++)
+    {
+        unsigned long readCount = mReadCounts[i];
+        OSMemoryBarrier();
+        unsigned long writeCount = mWriteCounts[i];
+        OSMemoryBarrier();
+        
+        LockFreeQueueTraceRecord *buffer = &mRecords[i * mRecordsPerThread];
+        
+        while (readCount != writeCount)
+        {
+            unsigned long position = readCount % mRecordsPerThread;
+            unsigned long count = writeCount - readCount;
+            
+            if (position + count > mRecordsPerThread)
+            {
+                count = mRecordsPerThread - position;
+            }
+            
+            fwrite(&buffer[position], sizeof(LockFreeQueueTraceRecord), count, mFile);
+            readCount += count;
+            result += count;
+        }
+        
+        OSMemoryBarrier();
+        mReadCounts[i] = readCount;
+    }
+    
+    fflush(mFile);
+    
+    return result;
+}
+
+/**
+ \brief count of records lost because a buffer was full or there were too many threads
+ */
+unsigned long LockFreeQueueTracer::DroppedRecordCount()
+{
+    unsigned long result = (unsigned long)mThreadlessDroppedCount;
+    
+    for (unsigned long i=0; i<kMaxTraceThreadCount; i++)
+    {
+        result += mDroppedCounts[i];
+    }
+    
+    return result;
+}
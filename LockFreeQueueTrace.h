@@ -0,0 +1,97 @@
+//
+//  LockFreeQueueTrace.h
+//
+//  Created by agent on 19.10.26.
+//
+// Copyright (c) 2026, agent
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// - Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+#ifndef __LockFreeQueueTrace__
+#define __LockFreeQueueTrace__
+
+#include "LockFreeQueue.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+const static unsigned long kMaxTraceThreadCount = 16; //!< hardcoded max count of threads a LockFreeQueueTracer keeps buffers for
+
+/// \brief One traced call, exactly as it is written to the trace file.
+typedef struct {
+    uint64_t mTimestamp;    //!< mach_absolute_time() when the call returned
+    uint64_t mThread;       //!< pthread_self() of the calling thread
+    uint32_t mByteCount;    //!< reserved or stored byte count. For fetch the returned byte count or, if nothing was returned, the buffer length.
+    uint8_t mOperation;     //!< LockFreeQueueTraceOperation
+    uint8_t mReturnCode;    //!< LockFreeQueueReturnCode
+    uint8_t mLane;          //!< lane reserved into, stored into or fetched from
+    uint8_t mUnused;
+} LockFreeQueueTraceRecord;
+
+/// \brief Start of a trace file. LockFreeQueueTraceRecords follow until the end of the file.
+typedef struct {
+    char mMagic[4];             //!< "LFQT"
+    uint32_t mVersion;          //!< kLockFreeQueueTraceVersion
+    uint32_t mTimebaseNumer;    //!< mach_timebase_info of the recording machine, timestamp * numer / denom is nanoseconds
+    uint32_t mTimebaseDenom;
+    uint64_t mDataRingLength;   //!< ring length of the traced queue
+    uint64_t mMaxMessageCount;  //!< kMaxMessageCount of the traced queue
+} LockFreeQueueTraceFileHeader;
+
+const static uint32_t kLockFreeQueueTraceVersion = 1;
+
+/// \brief Records ReserveRange, Store and Fetch calls of a LockFreeQueue.
+///
+/// Every thread that calls into a traced queue gets its own record buffer, so recording
+/// never waits and never allocates. A full buffer drops records. Some other thread has
+/// to call Flush regularly to move the records into the trace file.
+class LockFreeQueueTracer
+{
+private:
+    FILE *mFile;
+    pthread_key_t mBufferKey;               // per thread: buffer index + 1
+    
+    LockFreeQueueTraceRecord *mRecords;     // kMaxTraceThreadCount buffers of mRecordsPerThread records
+    unsigned long mRecordsPerThread;
+    volatile int32_t mBufferCount;          // count of claimed buffers, may exceed kMaxTraceThreadCount
+    
+    volatile unsigned long mWriteCounts[kMaxTraceThreadCount];  // written by the traced thread
+    volatile unsigned long mReadCounts[kMaxTraceThreadCount];   // written by Flush
+    volatile unsigned long mDroppedCounts[kMaxTraceThreadCount]; // written by the traced thread
+    volatile int32_t mThreadlessDroppedCount; // records of threads beyond kMaxTraceThreadCount
+    
+public:
+    LockFreeQueueTracer();
+    ~LockFreeQueueTracer();
+    bool InitWithPathRecordsPerThread(const char *inPath, unsigned long inRecordsPerThread, unsigned long inDataRingLength);
+    
+    void            Record(LockFreeQueueTraceOperation inOperation, unsigned long inByteCount, unsigned long inLane, LockFreeQueueReturnCode inReturnCode);
+    static void     TraceFunction(void *inTracer, LockFreeQueueTraceOperation inOperation, unsigned long inByteCount, unsigned long inLane, LockFreeQueueReturnCode inReturnCode);
+    unsigned long   Flush();
+    unsigned long   DroppedRecordCount();
+};
+
+#endif /* defined(__LockFreeQueueTrace__) */
@@ -1,5 +1,268 @@
 #include "LockFreeQueue.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void testLanes()
+{
+    LockFreeQueue *queue = new LockFreeQueue();
+    queue->InitWithMaxBytesDoOverwrite(30, true);
+    
+    const char *blobs[5] = {"bulk1", "bulk2", "CTRL", "bulk3", "HI"};
+    unsigned long lanes[5] = {0, 0, 2, 0, 3};
+    char fetchBuffer[20];
+    unsigned long fetchedByteCount = 0;
+    
+    RangeList reserveRangeList;
+    RangeList storeRangeList;
+    RangeList fetchRangeListA;
+    RangeList fetchRangeListB;
+    
+    printf("\n\nlanes:\n");
+    for (int i=0; i<5; i++)
+    {
+        queue->ReserveRange(strlen(blobs[i]), &reserveRangeList, lanes[i]);
+        queue->Store(blobs[i], strlen(blobs[i]), &reserveRangeList, &storeRangeList);
+    }
+    queue->DebugPrintDataBufferList();
+    
+    // expect HI, CTRL, bulk1, bulk2, bulk3. The bytes of HI and CTRL stay taken until bulk1 and bulk2 are fetched.
+    bool useANext = true;
+    for (int i=0; i<6; i++)
+    {
+        LockFreeQueueReturnCode returnCode = queue->Fetch(fetchBuffer, 20, useANext ? &fetchRangeListA : &fetchRangeListB, &fetchedByteCount);
+        if (returnCode == LockFreeQueue_OK)
+        {
+            useANext = !useANext;
+        }
+        fetchBuffer[fetchedByteCount] = 0;
+        printf("fetched %d: [%s]\n", returnCode, fetchBuffer);
+        queue->DebugPrintDataBufferList();
+    }
+    
+    printf("lane %lu: %s\n", kLaneCount, queue->ReserveRange(1, &reserveRangeList, kLaneCount) == LockFreeQueue_invalidLane ? "invalid, OK" : "FAILED");
+    
+    while(queue->InternalizeRangeList(&storeRangeList) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&reserveRangeList) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&fetchRangeListA) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&fetchRangeListB) != LockFreeQueue_OK)
+        ;
+    delete queue;
+    
+    // RangeList can't hold more than kMaxMessageCount ranges, even with space left in the ring
+    queue = new LockFreeQueue();
+    queue->InitWithMaxBytesDoOverwrite(kMaxMessageCount * 2, true);
+    
+    for (unsigned long i=0; i<kMaxMessageCount; i++)
+    {
+        queue->ReserveRange(1, &reserveRangeList);
+        queue->Store("m", 1, &reserveRangeList, &storeRangeList);
+    }
+    printf("message %lu: %s\n", kMaxMessageCount + 1, queue->ReserveRange(1, &reserveRangeList) == LockFreeQueue_notEnoughSpaceLeft ? "not enough space, OK" : "FAILED");
+    
+    while(queue->InternalizeRangeList(&storeRangeList) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&reserveRangeList) != LockFreeQueue_OK)
+        ;
+    delete queue;
+}
+
+void testSpill()
+{
+    LockFreeQueue *queue = new LockFreeQueue();
+    queue->InitWithMaxBytesDoOverwrite(10, true);
+    
+    char spillDirectory[] = "/tmp/LockFreeQueueTest-XXXXXX";
+    mkdtemp(spillDirectory);
+    queue->InitSpillWithDirectorySegmentBytes(spillDirectory, 64);
+    
+    char fetchBuffer[20];
+    unsigned long fetchedByteCount = 0;
+    
+    RangeList reserveRangeList;
+    RangeList storeRangeList;
+    RangeList fetchRangeListA;
+    RangeList fetchRangeListB;
+    bool useANext = true;
+    
+    printf("\n\nspill:\n");
+    
+    // fill the ring exactly, there must not be a single byte left
+    queue->ReserveRange(5, &reserveRangeList);
+    queue->Store("aaaaa", 5, &reserveRangeList, &storeRangeList);
+    queue->ReserveRange(5, &reserveRangeList);
+    queue->Store("bbbbb", 5, &reserveRangeList, &storeRangeList);
+    queue->DebugPrintDataBufferList();
+    printf("full ring: %s\n", queue->ReserveRange(1, &reserveRangeList) == LockFreeQueue_notEnoughSpaceLeft ? "not enough space, OK" : "FAILED");
+    
+    // spilled blobs come after the older ring blobs, even if a newer lane 3 blob overtakes them
+    queue->Spill("SSSSS", 5);
+    queue->Fetch(fetchBuffer, 20, useANext ? &fetchRangeListA : &fetchRangeListB, &fetchedByteCount);
+    useANext = !useANext;
+    queue->ReserveRange(2, &reserveRangeList, 3);
+    queue->Store("HH", 2, &reserveRangeList, &storeRangeList);
+    
+    // two of these fit into one 64 byte segment
+    const char *spilledBlobs[4] = {"spilled-01", "spilled-02", "spilled-03", "spilled-04"};
+    for (int i=0; i<4; i++)
+    {
+        queue->Spill(spilledBlobs[i], 10);
+    }
+    queue->DebugPrintDataBufferList();
+    
+    // expect HH, bbbbb, SSSSS and the four spilled blobs
+    LockFreeQueueReturnCode returnCode;
+    do
+    {
+        returnCode = queue->Fetch(fetchBuffer, 20, useANext ? &fetchRangeListA : &fetchRangeListB, &fetchedByteCount);
+        if (returnCode == LockFreeQueue_OK)
+        {
+            useANext = !useANext;
+        }
+        fetchBuffer[fetchedByteCount] = 0;
+        printf("fetched %d: [%s]\n", returnCode, fetchBuffer);
+    } while (returnCode == LockFreeQueue_OK);
+    
+    // spilled blobs are lane 0, a lane 3 blob stored after them is fetched first
+    queue->ReserveRange(5, &reserveRangeList);
+    queue->Store("ccccc", 5, &reserveRangeList, &storeRangeList);
+    queue->ReserveRange(5, &reserveRangeList);
+    queue->Store("ddddd", 5, &reserveRangeList, &storeRangeList);
+    for (int i=0; i<4; i++)
+    {
+        queue->Spill(spilledBlobs[i], 10);
+    }
+    for (int i=0; i<2; i++)
+    {
+        queue->Fetch(fetchBuffer, 20, useANext ? &fetchRangeListA : &fetchRangeListB, &fetchedByteCount);
+        useANext = !useANext;
+    }
+    queue->ReserveRange(4, &reserveRangeList, 3);
+    queue->Store("CTRL", 4, &reserveRangeList, &storeRangeList);
+    
+    // expect CTRL and the four spilled blobs
+    do
+    {
+        returnCode = queue->Fetch(fetchBuffer, 20, useANext ? &fetchRangeListA : &fetchRangeListB, &fetchedByteCount);
+        if (returnCode == LockFreeQueue_OK)
+        {
+            useANext = !useANext;
+        }
+        fetchBuffer[fetchedByteCount] = 0;
+        printf("fetched %d: [%s]\n", returnCode, fetchBuffer);
+    } while (returnCode == LockFreeQueue_OK);
+    
+    // Fetch leaves the segment files to the storing thread
+    queue->DeleteFetchedSpillSegments();
+    printf("segments: %s\n", rmdir(spillDirectory) == 0 ? "deleted, OK" : "FAILED, still there");
+    
+    // an empty blob doesn't make the ring look full
+    queue->ReserveRange(0, &reserveRangeList);
+    queue->Store("", 0, &reserveRangeList, &storeRangeList);
+    printf("after empty blob: %s\n", queue->ReserveRange(3, &reserveRangeList) == LockFreeQueue_OK ? "reserved, OK" : "FAILED");
+    queue->Store("eee", 3, &reserveRangeList, &storeRangeList);
+    queue->DebugPrintDataBufferList();
+    
+    while(queue->InternalizeRangeList(&storeRangeList) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&reserveRangeList) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&fetchRangeListA) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&fetchRangeListB) != LockFreeQueue_OK)
+        ;
+    delete queue;
+}
+
+static void printBroadcastFetch(LockFreeQueue *queue, unsigned long subscriber, const char *name)
+{
+    char fetchBuffer[20];
+    unsigned long fetchedByteCount = 0;
+    
+    LockFreeQueueReturnCode returnCode = queue->FetchBroadcast(subscriber, fetchBuffer, 20, &fetchedByteCount);
+    fetchBuffer[fetchedByteCount] = 0;
+    printf("%s fetched %d: [%s]\n", name, returnCode, fetchBuffer);
+}
+
+void testBroadcast()
+{
+    LockFreeQueue *queue = new LockFreeQueue();
+    queue->InitWithMaxBytesDoOverwrite(20, true);
+    queue->InitBroadcastDoDetachLaggards(true);
+    
+    RangeList reserveRangeList;
+    RangeList storeRangeList;
+    
+    unsigned long recorder;
+    unsigned long meter;
+    queue->Subscribe(&recorder);
+    queue->Subscribe(&meter);
+    
+    printf("\n\nbroadcast:\n");
+    
+    // a normal queue has no subscribers, Fetch would take the bytes away underneath them
+    LockFreeQueue *normalQueue = new LockFreeQueue();
+    normalQueue->InitWithMaxBytesDoOverwrite(20, true);
+    unsigned long subscriber;
+    printf("normal queue: %s\n", normalQueue->Subscribe(&subscriber) == LockFreeQueue_notSubscribed ? "can't subscribe, OK" : "FAILED");
+    delete normalQueue;
+    
+    const char *blobs[7] = {"one!!", "two!!", "three", "four!", "five!", "six!!", "seven"};
+    
+    for (int i=0; i<2; i++)
+    {
+        queue->ReserveRange(5, &reserveRangeList);
+        queue->Store(blobs[i], 5, &reserveRangeList, &storeRangeList);
+    }
+    
+    // both get both blobs
+    printBroadcastFetch(queue, recorder, "recorder");
+    printBroadcastFetch(queue, recorder, "recorder");
+    printBroadcastFetch(queue, recorder, "recorder");
+    printBroadcastFetch(queue, meter, "meter");
+    
+    // one!! is only given back now, as the meter has passed it. two!! stays.
+    queue->ReserveRange(5, &reserveRangeList);
+    queue->Store(blobs[2], 5, &reserveRangeList, &storeRangeList);
+    queue->DebugPrintDataBufferList();
+    
+    // too long for the ring, must not detach anyone
+    printf("too long: %s\n", queue->ReserveRange(21, &reserveRangeList) == LockFreeQueue_notEnoughSpaceLeft ? "not enough space, OK" : "FAILED");
+    printBroadcastFetch(queue, meter, "meter");
+    
+    // the meter stalls, the ring runs full and the meter is detached
+    for (int i=3; i<7; i++)
+    {
+        queue->ReserveRange(5, &reserveRangeList);
+        queue->Store(blobs[i], 5, &reserveRangeList, &storeRangeList);
+        printBroadcastFetch(queue, recorder, "recorder");
+    }
+    queue->DebugPrintDataBufferList();
+    printBroadcastFetch(queue, meter, "meter");
+    printBroadcastFetch(queue, recorder, "recorder");
+    
+    // a new meter only gets what is stored after it subscribed
+    queue->Unsubscribe(meter);
+    queue->Subscribe(&meter);
+    queue->ReserveRange(5, &reserveRangeList);
+    queue->Store("eight", 5, &reserveRangeList, &storeRangeList);
+    printBroadcastFetch(queue, meter, "meter");
+    printBroadcastFetch(queue, recorder, "recorder");
+    printBroadcastFetch(queue, meter, "meter");
+    
+    queue->Unsubscribe(meter);
+    queue->Unsubscribe(recorder);
+    
+    while(queue->InternalizeRangeList(&storeRangeList) != LockFreeQueue_OK)
+        ;
+    while(queue->InternalizeRangeList(&reserveRangeList) != LockFreeQueue_OK)
+        ;
+    delete queue;
+}
 
 void testSome()
 {
@@ -62,6 +325,10 @@ void testSome()
         ;
     while(queue->InternalizeRangeList(&secondFetchRangeList) != LockFreeQueue_OK)
         ;
+    
+    testLanes();
+    testSpill();
+    testBroadcast();
 }
 
 